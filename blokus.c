@@ -2,12 +2,18 @@
 // Copyright (c) 2017 Chuck Coffing <clc@alum.mit.edu>
 // License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>
 
-#include <SDL/SDL.h>
+#if defined(DEBUG) || defined(STATS)
+#define ENABLE_STATS
+#define _POSIX_C_SOURCE 199309L // clock_gettime
+#endif
+
+#include <SDL2/SDL.h>
 
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #define SCREENX 1024
@@ -16,9 +22,17 @@
 #define SQY 30
 #define BOARDX 20
 #define BOARDY 20
-#define numDefaultPieces (sizeof(defaultPieces) / sizeof(struct Piece))
 #define numPlayers 4
-#define MASK(x, y, width) (1 << ((y) * (width) + (x)))
+#define MASK(x, y, width) ((uint64_t)1 << ((y) * (width) + (x)))
+#define TRAYW ((SCREENX - BOARDX * SQX) / 2)
+#define TRAYH (SCREENY / 2)
+#define MINTRAYSQUARE 5
+#define MAXGENERATEDCELLS 7 // Larger sets don't fit in the trays even at MINTRAYSQUARE
+#define RGB(r, g, b) ((uint32_t)(r) << 24 | (uint32_t)(g) << 16 | (uint32_t)(b) << 8 | 0xff)
+#define ATLASW 128
+#define ATLASH 64
+#define ATLASTILE 64 // Squares are rasterized once at this size and scaled
+#define BATCHQUADS 8192
 
 struct Player;
 
@@ -31,12 +45,15 @@ enum PieceStatus {
     StatusPlayed,
 };
 
+// bits is x*y; body, touching and diag are over the (x+2)*(y+2) contact
+// window, so a piece must satisfy (x+2)*(y+2) <= 64.
 struct Piece {
     int x;
     int y;
-    int bits;
-    uint32_t touching;
-    uint32_t diag;
+    uint64_t bits;
+    uint64_t body;
+    uint64_t touching;
+    uint64_t diag;
     struct Player* player;
     int num;
     enum PieceStatus inPlay;
@@ -58,74 +75,528 @@ struct Board {
     bool dirty; // layout needed?
 };
 
-struct Piece defaultPieces[] = {
-    { 1, 1, 0x001, 0, 0, 0, 0, 0, 0, 0 },
-    { 1, 2, 0x003, 0, 0, 0, 0, 0, 0, 0 },
-    { 1, 3, 0x007, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 2, 0x00d, 0, 0, 0, 0, 0, 0, 0 },
-    { 1, 4, 0x00f, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 3, 0x03a, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 3, 0x01d, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 2, 0x00f, 0, 0, 0, 0, 0, 0, 0 },
-    { 3, 2, 0x033, 0, 0, 0, 0, 0, 0, 0 },
-    { 1, 5, 0x01f, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 4, 0x0ea, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 4, 0x07a, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 3, 0x03e, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 3, 0x03b, 0, 0, 0, 0, 0, 0, 0 },
-    { 2, 4, 0x05d, 0, 0, 0, 0, 0, 0, 0 },
-    { 3, 3, 0x1d2, 0, 0, 0, 0, 0, 0, 0 },
-    { 3, 3, 0x1c9, 0, 0, 0, 0, 0, 0, 0 },
-    { 3, 3, 0x133, 0, 0, 0, 0, 0, 0, 0 },
-    { 3, 3, 0x139, 0, 0, 0, 0, 0, 0, 0 },
-    { 3, 3, 0x0b9, 0, 0, 0, 0, 0, 0, 0 },
-    { 3, 3, 0x0ba, 0, 0, 0, 0, 0, 0, 0 },
-    { 0, 0, 0x000, 0, 0, 0, 0, 0, 0, 0 },
-};
-
 struct Player {
     int num;
     uint32_t color;
-    struct Piece* pieces[numDefaultPieces]; // Still to be played
+    struct Piece** pieces; // Still to be played; numPieces + terminator
     int moves;
     int homeX;
     int homeY;
 };
 
+static struct Piece* pieceSet = NULL; // Terminated by a piece with x == 0
+static int numPieces = 0;
 static struct Player* players[numPlayers];
 static struct Board* bg[4];
-static SDL_Surface* screen = NULL;
+static int traySquare;
+static SDL_Window* window = NULL;
+static SDL_Renderer* renderer = NULL;
+
+// Instrumentation.  Compiled in by debug builds and "make stats"; otherwise
+// the macros expand to nothing.  Each thread accumulates into its own
+// ThreadStats, which are merged when reporting at exit.
+enum Stat {
+    StatRedrawScreen,
+    StatBoardDraw,
+    StatDrawPiece,
+    StatDrawSquare,
+    StatRenderGeometry,
+    StatTrayPack,
+    StatCheckPieceFits,
+    StatFrames,
+    StatGeneratePieces,
+    StatGenerateNodes,
+    StatGenerateDuplicates,
+    StatAllocs,
+    NumStats
+};
 
-void InitPieces()
+#ifdef ENABLE_STATS
+#define MAXTRACEEVENTS (1 << 20) // Per thread; later events are dropped
+
+static const char* statNames[NumStats] = {
+    "RedrawScreen",
+    "Board_Draw",
+    "DrawPiece",
+    "DrawSquare",
+    "RenderGeometry",
+    "TrayPack",
+    "CheckPieceFits",
+    "Frames",
+    "GeneratePieces",
+    "GenerateNodes",
+    "GenerateDuplicates",
+    "Allocs",
+};
+
+struct TraceEvent {
+    enum Stat stat;
+    uint64_t start; // ns since statsEpoch
+    uint64_t dur;
+};
+
+struct ThreadStats {
+    uint64_t count[NumStats];
+    uint64_t ns[NumStats];
+    struct TraceEvent* trace;
+    int numTrace;
+    int maxTrace;
+    uint64_t dropped;
+    int tid;
+    struct ThreadStats* next;
+};
+
+static __thread struct ThreadStats* threadStats;
+static struct ThreadStats* allThreadStats;
+static int numThreadStats;
+static bool tracing;
+static uint64_t statsEpoch;
+
+static uint64_t Stats_Now()
 {
-    struct Piece* p;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-    for (int i = 0; (p = &defaultPieces[i])->x; ++i) {
-        p->num = i;
-        p->inPlay = StatusUnplayed;
-        for (int y = 0; y < p->y; ++y) {
-            for (int x = 0; x < p->x; ++x) {
-                if (p->bits & MASK(x, y, p->x)) {
-                    p->touching |= MASK(x + 1, y + 1, p->x + 2);
-                    p->touching |= MASK(x, y + 1, p->x + 2);
-                    p->touching |= MASK(x + 2, y + 1, p->x + 2);
-                    p->touching |= MASK(x + 1, y, p->x + 2);
-                    p->touching |= MASK(x + 1, y + 2, p->x + 2);
-                }
+static struct ThreadStats* Stats_Thread()
+{
+    struct ThreadStats* s = threadStats;
+
+    if (!s) {
+        s = threadStats = (struct ThreadStats*)calloc(1, sizeof(struct ThreadStats));
+        s->tid = __sync_add_and_fetch(&numThreadStats, 1);
+        do {
+            s->next = allThreadStats;
+        } while (!__sync_bool_compare_and_swap(&allThreadStats, s->next, s));
+    }
+    return s;
+}
+
+static void Stats_End(enum Stat stat, uint64_t start)
+{
+    struct ThreadStats* s = Stats_Thread();
+    uint64_t dur = Stats_Now() - start;
+
+    s->count[stat]++;
+    s->ns[stat] += dur;
+    if (!tracing)
+        return;
+    if (s->numTrace == s->maxTrace) {
+        if (s->maxTrace == MAXTRACEEVENTS) {
+            s->dropped++;
+            return;
+        }
+        s->maxTrace = s->maxTrace ? s->maxTrace * 2 : 4096;
+        s->trace = (struct TraceEvent*)realloc(s->trace, sizeof(struct TraceEvent) * s->maxTrace);
+    }
+    s->trace[s->numTrace++] = (struct TraceEvent) { stat, start - statsEpoch, dur };
+}
+
+#define STATS_COUNT(stat, n) (Stats_Thread()->count[stat] += (n))
+#define STATS_BEGIN(stat) uint64_t statsStart_##stat = Stats_Now()
+#define STATS_END(stat) Stats_End(stat, statsStart_##stat)
+
+void Stats_Start(bool trace)
+{
+    statsEpoch = Stats_Now();
+    tracing = trace;
+}
+
+static void Stats_Print(FILE* f)
+{
+    uint64_t count[NumStats] = { 0 };
+    uint64_t ns[NumStats] = { 0 };
+
+    for (struct ThreadStats* s = allThreadStats; s; s = s->next) {
+        for (int i = 0; i < NumStats; ++i) {
+            count[i] += s->count[i];
+            ns[i] += s->ns[i];
+        }
+    }
+    fprintf(f, "%-20s %12s %12s %10s\n", "", "count", "total ms", "avg us");
+    for (int i = 0; i < NumStats; ++i) {
+        if (ns[i])
+            fprintf(f, "%-20s %12llu %12.3f %10.3f\n", statNames[i], (unsigned long long)count[i],
+                ns[i] / 1e6, ns[i] / 1e3 / count[i]);
+        else
+            fprintf(f, "%-20s %12llu\n", statNames[i], (unsigned long long)count[i]);
+    }
+}
+
+// Chrome trace event format; load in chrome://tracing or ui.perfetto.dev.
+static bool Stats_WriteTrace(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    const char* sep = "";
+
+    if (!f) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return false;
+    }
+    fprintf(f, "{\"traceEvents\":[");
+    for (struct ThreadStats* s = allThreadStats; s; s = s->next) {
+        for (int i = 0; i < s->numTrace; ++i) {
+            struct TraceEvent* e = &s->trace[i];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", sep,
+                statNames[e->stat], s->tid, e->start / 1e3, e->dur / 1e3);
+            sep = ",";
+        }
+        if (s->dropped)
+            fprintf(stderr, "Trace: dropped %llu events on thread %d\n", (unsigned long long)s->dropped, s->tid);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    return fclose(f) == 0;
+}
+
+void Stats_Report(bool print, const char* traceFile)
+{
+    if (print)
+        Stats_Print(stderr);
+    if (traceFile)
+        Stats_WriteTrace(traceFile);
+}
+#else
+#define STATS_COUNT(stat, n) ((void)0)
+#define STATS_BEGIN(stat) ((void)0)
+#define STATS_END(stat) ((void)0)
+
+void Stats_Start(bool trace)
+{
+    (void)trace;
+}
+
+void Stats_Report(bool print, const char* traceFile)
+{
+    if (print || traceFile)
+        fprintf(stderr, "Built without statistics; rebuild with \"make stats\"\n");
+}
+#endif
+
+void Piece_ComputeContacts(struct Piece* p)
+{
+    int w = p->x + 2;
+
+    p->body = p->touching = p->diag = 0;
+    for (int y = 0; y < p->y; ++y) {
+        for (int x = 0; x < p->x; ++x) {
+            if (p->bits & MASK(x, y, p->x)) {
+                p->body |= MASK(x + 1, y + 1, w);
+                p->touching |= MASK(x + 1, y + 1, w);
+                p->touching |= MASK(x, y + 1, w);
+                p->touching |= MASK(x + 2, y + 1, w);
+                p->touching |= MASK(x + 1, y, w);
+                p->touching |= MASK(x + 1, y + 2, w);
+                p->diag |= MASK(x, y, w);
+                p->diag |= MASK(x + 2, y, w);
+                p->diag |= MASK(x, y + 2, w);
+                p->diag |= MASK(x + 2, y + 2, w);
             }
         }
-        p->diag = p->touching;
+    }
+    p->diag &= ~p->touching;
+}
+
+void Piece_Flip(struct Piece* p)
+{
+    struct Piece p2 = *p;
+
+    p2.bits = 0;
+    for (int y = 0; y < p->y; ++y) {
+        for (int x = 0; x < p->x; ++x) {
+            if (p->bits & MASK(x, y, p->x))
+                p2.bits |= MASK(p->x - x - 1, y, p->x);
+        }
+    }
+    Piece_ComputeContacts(&p2);
+    *p = p2;
+}
+
+void Piece_Rotate90(struct Piece* p)
+{
+    struct Piece p2 = *p;
+
+    p2.x = p->y;
+    p2.y = p->x;
+    p2.bits = 0;
+    for (int y = 0; y < p->y; ++y) {
+        for (int x = 0; x < p->x; ++x) {
+            if (p->bits & MASK(x, y, p->x))
+                p2.bits |= MASK(p->y - y - 1, x, p->y);
+        }
+    }
+    Piece_ComputeContacts(&p2);
+    *p = p2;
+}
+
+static int Piece_Compare(const struct Piece* a, const struct Piece* b)
+{
+    if (a->x != b->x)
+        return a->x - b->x;
+    if (a->y != b->y)
+        return a->y - b->y;
+    return (a->bits > b->bits) - (a->bits < b->bits);
+}
+
+// Replace p by the smallest of its 8 orientations, so that equal free
+// polyominoes compare equal.
+static void Piece_Canonicalize(struct Piece* p)
+{
+    struct Piece best = *p;
+    struct Piece cur = *p;
+
+    for (int i = 0; i < 8; ++i) {
+        if (i == 4)
+            Piece_Flip(&cur);
+        if (Piece_Compare(&cur, &best) < 0)
+            best = cur;
+        Piece_Rotate90(&cur);
+    }
+    *p = best;
+}
+
+static bool Piece_Has(const struct Piece* p, int x, int y)
+{
+    return x >= 0 && y >= 0 && x < p->x && y < p->y && (p->bits & MASK(x, y, p->x));
+}
+
+static bool Piece_FitsWindow(int x, int y)
+{
+    return x > 0 && y > 0 && (x + 2) * (y + 2) <= 64;
+}
+
+// Shrink the bounding box to the filled squares.
+static void Piece_Trim(struct Piece* p)
+{
+    int x0 = p->x, y0 = p->y, x1 = -1, y1 = -1;
+
+    for (int y = 0; y < p->y; ++y) {
+        for (int x = 0; x < p->x; ++x) {
+            if (Piece_Has(p, x, y)) {
+                x0 = x < x0 ? x : x0;
+                y0 = y < y0 ? y : y0;
+                x1 = x > x1 ? x : x1;
+                y1 = y > y1 ? y : y1;
+            }
+        }
+    }
+    struct Piece p2 = *p;
+    p2.x = x1 - x0 + 1;
+    p2.y = y1 - y0 + 1;
+    p2.bits = 0;
+    for (int y = 0; y < p2.y; ++y) {
+        for (int x = 0; x < p2.x; ++x) {
+            if (Piece_Has(p, x + x0, y + y0))
+                p2.bits |= MASK(x, y, p2.x);
+        }
+    }
+    *p = p2;
+}
+
+// True if every square can be reached from every other through shared edges.
+static bool Piece_Connected(const struct Piece* p)
+{
+    uint64_t seen = p->bits & -p->bits;
+    uint64_t prev = 0;
+
+    while (seen != prev) {
+        prev = seen;
         for (int y = 0; y < p->y; ++y) {
             for (int x = 0; x < p->x; ++x) {
-                if (p->bits & MASK(x, y, p->x)) {
-                    p->diag |= MASK(x, y, p->x + 2);
-                    p->diag |= MASK(x + 2, y, p->x + 2);
-                    p->diag |= MASK(x, y + 2, p->x + 2);
-                    p->diag |= MASK(x + 2, y + 2, p->x + 2);
+                if (!(seen & MASK(x, y, p->x)))
+                    continue;
+                if (Piece_Has(p, x - 1, y))
+                    seen |= MASK(x - 1, y, p->x);
+                if (Piece_Has(p, x + 1, y))
+                    seen |= MASK(x + 1, y, p->x);
+                if (Piece_Has(p, x, y - 1))
+                    seen |= MASK(x, y - 1, p->x);
+                if (Piece_Has(p, x, y + 1))
+                    seen |= MASK(x, y + 1, p->x);
+            }
+        }
+    }
+    return seen == p->bits;
+}
+
+// True if p is a rotation or reflection of one of set[0..n).
+static bool Piece_InSet(const struct Piece* p, const struct Piece* set, int n)
+{
+    struct Piece canon = *p;
+
+    Piece_Canonicalize(&canon);
+    for (int i = 0; i < n; ++i) {
+        struct Piece other = set[i];
+        Piece_Canonicalize(&other);
+        if (Piece_Compare(&canon, &other) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void AddPiece(struct Piece** set, int* n, int* cap, const struct Piece* p)
+{
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 32;
+        *set = (struct Piece*)realloc(*set, sizeof(struct Piece) * (*cap + 1));
+        STATS_COUNT(StatAllocs, 1);
+    }
+    (*set)[(*n)++] = *p;
+}
+
+static void InstallPieces(struct Piece* set, int n)
+{
+    free(pieceSet);
+    memset(&set[n], 0, sizeof(struct Piece));
+    pieceSet = set;
+    numPieces = n;
+}
+
+// Enumerate every free polyomino of 1..maxCells squares by growing each
+// polyomino of the previous size by one square and discarding duplicates.
+bool GeneratePieces(int maxCells)
+{
+    struct Piece* set = NULL;
+    int n = 0;
+    int cap = 0;
+    struct Piece mono = { .x = 1, .y = 1, .bits = 1 };
+
+    if (maxCells < 1 || maxCells > MAXGENERATEDCELLS) {
+        fprintf(stderr, "Polyomino size must be 1-%d\n", MAXGENERATEDCELLS);
+        return false;
+    }
+
+    STATS_BEGIN(StatGeneratePieces);
+    AddPiece(&set, &n, &cap, &mono);
+    for (int cells = 2, prevStart = 0; cells <= maxCells; ++cells) {
+        int prevEnd = n;
+        for (int k = prevStart; k < prevEnd; ++k) {
+            struct Piece src = set[k];
+            for (int y = -1; y <= src.y; ++y) {
+                for (int x = -1; x <= src.x; ++x) {
+                    if (Piece_Has(&src, x, y))
+                        continue;
+                    bool adjacent = Piece_Has(&src, x - 1, y) || Piece_Has(&src, x + 1, y)
+                        || Piece_Has(&src, x, y - 1) || Piece_Has(&src, x, y + 1);
+                    if (!adjacent)
+                        continue;
+
+                    struct Piece grown = { 0 };
+                    int ox = x < 0;
+                    int oy = y < 0;
+                    grown.x = src.x + (x < 0 || x >= src.x);
+                    grown.y = src.y + (y < 0 || y >= src.y);
+                    for (int j = 0; j < src.y; ++j) {
+                        for (int i = 0; i < src.x; ++i) {
+                            if (src.bits & MASK(i, j, src.x))
+                                grown.bits |= MASK(i + ox, j + oy, grown.x);
+                        }
+                    }
+                    grown.bits |= MASK(x + ox, y + oy, grown.x);
+                    Piece_Canonicalize(&grown);
+                    STATS_COUNT(StatGenerateNodes, 1);
+
+                    bool dup = false;
+                    for (int e = prevEnd; e < n && !dup; ++e)
+                        dup = Piece_Compare(&grown, &set[e]) == 0;
+                    if (dup)
+                        STATS_COUNT(StatGenerateDuplicates, 1);
+                    else
+                        AddPiece(&set, &n, &cap, &grown);
                 }
             }
         }
-        p->diag ^= p->touching;
+        prevStart = prevEnd;
+    }
+
+    InstallPieces(set, n);
+    STATS_END(StatGeneratePieces);
+    return true;
+}
+
+// One piece per line, rows separated by '/', 'X' filled and '.' empty, e.g.
+// "XX/X." for the small L.  Blank lines and lines starting with '#' are
+// ignored.  Pieces are trimmed to their filled squares; disconnected pieces
+// and rotations or reflections of an earlier piece are rejected.
+bool LoadPieces(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    char line[256];
+    struct Piece* set = NULL;
+    int n = 0;
+    int cap = 0;
+    int lineNum = 0;
+
+    if (!f) {
+        fprintf(stderr, "Unable to open %s\n", path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct Piece p = { 0 };
+        int x = 0;
+        bool ok = true;
+
+        ++lineNum;
+        if (line[0] == '#')
+            continue;
+        for (char* c = line; *c && *c != '\n' && *c != '\r'; ++c) {
+            if (*c == '/') {
+                if (p.y == 0)
+                    p.x = x;
+                ok = ok && x == p.x;
+                p.y++;
+                x = 0;
+            } else if (*c == 'X' || *c == '.') {
+                // Width is still 0 while reading the first row
+                int bit = p.y * p.x + x++;
+                if (bit >= 64)
+                    ok = false;
+                else if (*c == 'X')
+                    p.bits |= (uint64_t)1 << bit;
+            } else if (*c != ' ' && *c != '\t') {
+                ok = false;
+            }
+        }
+        if (!x && !p.y)
+            continue;
+        if (p.y == 0)
+            p.x = x;
+        ok = ok && x == p.x;
+        p.y++;
+        if (ok && p.bits)
+            Piece_Trim(&p);
+        const char* error = NULL;
+        if (!ok || !p.bits || !Piece_FitsWindow(p.x, p.y))
+            error = "bad piece";
+        else if (!Piece_Connected(&p))
+            error = "disconnected piece";
+        else if (Piece_InSet(&p, set, n))
+            error = "duplicate piece";
+        if (error) {
+            fprintf(stderr, "%s:%d: %s\n", path, lineNum, error);
+            fclose(f);
+            free(set);
+            return false;
+        }
+        AddPiece(&set, &n, &cap, &p);
+    }
+    fclose(f);
+    if (!n) {
+        fprintf(stderr, "%s: no pieces\n", path);
+        return false;
+    }
+    InstallPieces(set, n);
+    return true;
+}
+
+void InitPieces()
+{
+    struct Piece* p;
+
+    for (int i = 0; (p = &pieceSet[i])->x; ++i) {
+        p->num = i;
+        p->inPlay = StatusUnplayed;
+        Piece_ComputeContacts(p);
     }
 }
 
@@ -145,20 +616,28 @@ struct Board* Board_New(int nx, int ny, int sw, int sh)
     b->sh = sh;
     b->nx = nx;
     b->ny = ny;
-    b->pad = 2;
+    b->pad = sw >= 10 ? 2 : 1;
     b->x = 0;
     b->y = 0;
     b->pieces = (struct Piece**)malloc(sizeof(struct Piece*) * nx * ny);
     b->player = (struct Player**)malloc(sizeof(struct Player*) * nx * ny);
+    STATS_COUNT(StatAllocs, 3);
     Board_Clear(b);
-    b->color = SDL_MapRGB(screen->format, 0x70, 0x70, 0x70);
+    b->color = RGB(0x70, 0x70, 0x70);
     b->dirty = true;
     return b;
 }
 
+void Board_Delete(struct Board* b)
+{
+    free(b->pieces);
+    free(b->player);
+    free(b);
+}
+
 void Board_PlayPiece(struct Board* b, struct Piece* p, int x, int y)
 {
-    int mask = 1;
+    uint64_t mask = 1;
     bool anchored = false;
 
     assert(x >= 0 && y >= 0 && x + p->x <= b->nx && y + p->y <= b->ny);
@@ -184,10 +663,13 @@ struct Player* Player_New(int num, uint32_t color)
     struct Player* player = (struct Player*)malloc(sizeof(struct Player));
     int i = 0;
 
+    player->pieces = (struct Piece**)malloc(sizeof(struct Piece*) * (numPieces + 1));
+    STATS_COUNT(StatAllocs, 2);
     while (1) {
         player->pieces[i] = (struct Piece*)malloc(sizeof(struct Piece));
-        *player->pieces[i] = defaultPieces[i];
-        if (!defaultPieces[i].x)
+        STATS_COUNT(StatAllocs, 1);
+        *player->pieces[i] = pieceSet[i];
+        if (!pieceSet[i].x)
             break;
         player->pieces[i]->player = player;
         ++i;
@@ -206,20 +688,18 @@ void Player_Delete(struct Player* player)
         done = player->pieces[i]->x == 0;
         free(player->pieces[i++]);
     } while (!done);
+    free(player->pieces);
     free(player);
 }
 
 uint32_t PlayerColor(int player)
 {
-    static int init;
-    static uint32_t colors[4];
-    if (!init) {
-        init = 1;
-        colors[0] = SDL_MapRGBA(screen->format, 0x10, 0x10, 0xf0, 0xff);
-        colors[1] = SDL_MapRGBA(screen->format, 0xf0, 0xf0, 0x10, 0xff);
-        colors[2] = SDL_MapRGBA(screen->format, 0xf0, 0x10, 0x10, 0xff);
-        colors[3] = SDL_MapRGBA(screen->format, 0x10, 0xf0, 0x10, 0xff);
-    }
+    static const uint32_t colors[4] = {
+        RGB(0x10, 0x10, 0xf0),
+        RGB(0xf0, 0xf0, 0x10),
+        RGB(0xf0, 0x10, 0x10),
+        RGB(0x10, 0xf0, 0x10),
+    };
 
     return colors[player];
 }
@@ -256,46 +736,6 @@ void DeinitPlayers()
     }
 }
 
-void Piece_Flip(struct Piece* p)
-{
-    int mask = 1;
-    struct Piece p2 = *p;
-
-    p2.bits = 0;
-    for (int y = 0; y < p->y; ++y) {
-        for (int x = 0; x < p->x; ++x) {
-            if (p->bits & mask) {
-                p2.bits |= (1 << (p->x - x - 1 + (y * p->x)));
-            }
-            mask <<= 1;
-        }
-    }
-    *p = p2;
-}
-
-void Piece_Rotate90(struct Piece* p)
-{
-    int mask = 1;
-    struct Piece p2 = *p;
-
-    p2.x = p->y;
-    p2.y = p->x;
-    p2.bits = p2.diag = p2.touching = 0;
-    for (int y = 0; y < p->y; ++y) {
-        for (int x = 0; x < p->x; ++x) {
-            int mask2 = (1 << (x * p->y + (p->y - y - 1)));
-            if (p->bits & mask)
-                p2.bits |= mask2;
-            // if (p->diag & mask)
-            //    p2.diag |= mask2;
-            // if (p->touching & mask)
-            //    p2.touching |= mask2;
-            mask <<= 1;
-        }
-    }
-    *p = p2;
-}
-
 bool Piece_CheckCovers(int x, int y, struct Piece* p, int coverX, int coverY)
 {
     if (x > coverX || y > coverY || x + p->x <= coverX || y + p->y <= coverY)
@@ -303,36 +743,41 @@ bool Piece_CheckCovers(int x, int y, struct Piece* p, int coverX, int coverY)
     return p->bits & MASK(coverX - x, coverY - y, p->x);
 }
 
+// Gathers the contact window around the piece into per-player masks and tests
+// them against the precomputed piece masks, so the inner loop has no
+// data-dependent branches whatever the piece size.
 bool CheckPieceFits(struct Board* b, int x, int y, struct Piece* p, struct Player* cantTouch,
     struct Player* cantDiag, struct Player* mustDiag)
 {
     if (x < 0 || y < 0 || x > b->nx - p->x || y > b->ny - p->y)
         return 0;
-    int mask = 1;
-    for (int j = 0; j < p->y; ++j) {
-        for (int i = 0; i < p->x; ++i) {
-            if (p->bits & mask) {
-                if (b->player[(x + i) + (y + j) * b->nx])
-                    return 0;
-            }
-            mask <<= 1;
-        }
-    }
-    bool foundMustDiag = false;
-    for (int j = -1; j <= p->y; ++j) {
-        for (int i = -1; i <= p->x; ++i) {
-            if (x + i < 0 || y + j < 0 || x + i >= b->nx || y + j >= b->ny)
-                continue;
-            struct Player* player = b->player[(x + i) + (y + j) * b->nx];
-            if (mustDiag && player == mustDiag && (p->diag & MASK(i + 1, j + 1, p->x + 2)))
-                foundMustDiag = true;
-            if (cantDiag && player == cantDiag && (p->diag & MASK(i + 1, j + 1, p->x + 2)))
-                return 0;
-            if (cantTouch && player == cantTouch && (p->touching & MASK(i + 1, j + 1, p->x + 2)))
-                return 0;
+    STATS_BEGIN(StatCheckPieceFits);
+    int w = p->x + 2;
+    int j0 = y > 0 ? -1 : 0;
+    int j1 = y + p->y < b->ny ? p->y : p->y - 1;
+    int i0 = x > 0 ? -1 : 0;
+    int i1 = x + p->x < b->nx ? p->x : p->x - 1;
+    uint64_t occupied = 0;
+    uint64_t touchOwned = 0;
+    uint64_t diagOwned = 0;
+    uint64_t mustOwned = 0;
+    for (int j = j0; j <= j1; ++j) {
+        struct Player** row = &b->player[(y + j) * b->nx + x];
+        for (int i = i0; i <= i1; ++i) {
+            struct Player* player = row[i];
+            uint64_t bit = MASK(i + 1, j + 1, w);
+            occupied |= bit & -(uint64_t)(player != 0);
+            touchOwned |= bit & -(uint64_t)(player == cantTouch);
+            diagOwned |= bit & -(uint64_t)(player == cantDiag);
+            mustOwned |= bit & -(uint64_t)(player == mustDiag);
         }
     }
-    return !(mustDiag && !foundMustDiag);
+    bool fits = !(occupied & p->body)
+        && !(cantTouch && (touchOwned & p->touching))
+        && !(cantDiag && (diagOwned & p->diag))
+        && (!mustDiag || (mustOwned & p->diag));
+    STATS_END(StatCheckPieceFits);
+    return fits;
 }
 
 bool CheckPiecePlayable(struct Board* b, int x, int y, struct Piece* p)
@@ -347,6 +792,125 @@ bool CheckPiecePlayable(struct Board* b, int x, int y, struct Piece* p)
     return false;
 }
 
+// Everything is drawn from one atlas texture: a bevelled square that is
+// tinted by vertex color, and a solid texel block for connectors and fills.
+// Quads are batched and submitted with SDL_RenderGeometry.  The layout is
+// always SCREENX*SCREENY logical pixels, which the renderer scales to the
+// window size.
+enum AtlasTile {
+    AtlasSquare,
+    AtlasSolid,
+    NumAtlasTiles
+};
+
+static SDL_Texture* atlas = NULL;
+static SDL_FPoint atlasUV[NumAtlasTiles][2];
+static struct {
+    SDL_Vertex vertices[BATCHQUADS * 4];
+    int indices[BATCHQUADS * 6];
+    int quads;
+} batch;
+
+static SDL_Texture* Render_CreateAtlas()
+{
+    SDL_Surface* s = SDL_CreateRGBSurfaceWithFormat(0, ATLASW, ATLASH, 32, SDL_PIXELFORMAT_RGBA32);
+    if (!s)
+        return NULL;
+
+    uint32_t* pixels = (uint32_t*)s->pixels;
+    int pitch = s->pitch / 4;
+    int bevel = ATLASTILE / 16;
+    SDL_FillRect(s, NULL, SDL_MapRGB(s->format, 0xff, 0xff, 0xff));
+    for (int y = 0; y < ATLASTILE; ++y) {
+        for (int x = 0; x < ATLASTILE; ++x) {
+            if (x >= ATLASTILE - bevel || y >= ATLASTILE - bevel)
+                pixels[y * pitch + x] = SDL_MapRGB(s->format, 0xb0, 0xb0, 0xb0);
+        }
+    }
+    // Sample well inside each tile so linear filtering never bleeds.
+    atlasUV[AtlasSquare][0] = (SDL_FPoint) { 0.5f / ATLASW, 0.5f / ATLASH };
+    atlasUV[AtlasSquare][1] = (SDL_FPoint) { (ATLASTILE - 0.5f) / ATLASW, (ATLASTILE - 0.5f) / ATLASH };
+    atlasUV[AtlasSolid][0] = atlasUV[AtlasSolid][1]
+        = (SDL_FPoint) { (ATLASW - ATLASTILE / 2.0f) / ATLASW, 0.5f };
+
+    SDL_Texture* t = SDL_CreateTextureFromSurface(renderer, s);
+    SDL_FreeSurface(s);
+    if (t)
+        SDL_SetTextureBlendMode(t, SDL_BLENDMODE_NONE);
+    return t;
+}
+
+bool Render_Init()
+{
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
+    window = SDL_CreateWindow("Blokus", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREENX, SCREENY,
+        SDL_WINDOW_RESIZABLE);
+    if (!window)
+        return false;
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (!renderer)
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    if (!renderer)
+        return false;
+    SDL_RenderSetLogicalSize(renderer, SCREENX, SCREENY);
+    atlas = Render_CreateAtlas();
+    if (!atlas)
+        return false;
+
+    for (int q = 0; q < BATCHQUADS; ++q) {
+        static const int corners[6] = { 0, 1, 2, 2, 1, 3 };
+        for (int i = 0; i < 6; ++i)
+            batch.indices[q * 6 + i] = q * 4 + corners[i];
+    }
+    return true;
+}
+
+void Render_Deinit()
+{
+    SDL_DestroyTexture(atlas);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+}
+
+static void Render_Flush()
+{
+    if (batch.quads) {
+        STATS_COUNT(StatRenderGeometry, 1);
+        SDL_RenderGeometry(renderer, atlas, batch.vertices, batch.quads * 4, batch.indices, batch.quads * 6);
+        batch.quads = 0;
+    }
+}
+
+static void Render_Quad(const SDL_Rect* r, enum AtlasTile tile, uint32_t color)
+{
+    if (batch.quads == BATCHQUADS)
+        Render_Flush();
+
+    SDL_Color c = { color >> 24, color >> 16, color >> 8, color };
+    SDL_FPoint* uv = atlasUV[tile];
+    SDL_Vertex* v = &batch.vertices[batch.quads++ * 4];
+    for (int i = 0; i < 4; ++i) {
+        v[i].position.x = r->x + ((i & 1) ? r->w : 0);
+        v[i].position.y = r->y + ((i & 2) ? r->h : 0);
+        v[i].color = c;
+        v[i].tex_coord.x = uv[i & 1].x;
+        v[i].tex_coord.y = uv[(i & 2) >> 1].y;
+    }
+}
+
+void Render_Clear()
+{
+    batch.quads = 0;
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xff);
+    SDL_RenderClear(renderer);
+}
+
+void Render_Present()
+{
+    Render_Flush();
+    SDL_RenderPresent(renderer);
+}
+
 void DrawBetween(struct Board* b, int x, int y, int dir, uint32_t color)
 {
     SDL_Rect r;
@@ -377,7 +941,7 @@ void DrawBetween(struct Board* b, int x, int y, int dir, uint32_t color)
         r.h = b->pad;
         break;
     }
-    SDL_FillRect(screen, &r, color);
+    Render_Quad(&r, AtlasSolid, color);
 }
 
 void DrawSquare(struct Board* b, int x, int y, uint32_t color)
@@ -386,40 +950,43 @@ void DrawSquare(struct Board* b, int x, int y, uint32_t color)
         .y = b->y + (y * b->sh) + b->pad,
         .w = b->sw - b->pad * 2,
         .h = b->sh - b->pad * 2 };
-    SDL_FillRect(screen, &r, color);
+    STATS_COUNT(StatDrawSquare, 1);
+    Render_Quad(&r, AtlasSquare, color);
 }
 
 void DrawPiece(struct Board* board, struct Piece* p, int x, int y)
 {
-    int mask = 1;
+    uint64_t mask = 1;
     uint32_t color = p->player->color;
     uint32_t outline = color;
 
-    Uint8 r, g, b;
-    SDL_GetRGB(color, screen->format, &r, &g, &b);
+    Uint8 r = color >> 24;
+    Uint8 g = color >> 16;
+    Uint8 b = color >> 8;
     if (p->inPlay == StatusDead) {
         r >>= 1;
         g >>= 1;
         b >>= 1;
-        outline = color = SDL_MapRGB(screen->format, r, g, b);
+        outline = color = RGB(r, g, b);
     } else if (p->inPlay == StatusPlayed) {
         r *= 0.8;
         g *= 0.8;
         b *= 0.8;
-        outline = SDL_MapRGB(screen->format, r, g, b);
+        outline = RGB(r, g, b);
     } else if (p->inPlay == StatusPlayable) {
         outline = color;
     } else if (p->inPlay == StatusNotPlayable) {
         r *= 0.8;
         g *= 0.8;
         b *= 0.8;
-        color = SDL_MapRGB(screen->format, r, g, b);
+        color = RGB(r, g, b);
         r *= 0.8;
         g *= 0.8;
         b *= 0.8;
-        outline = SDL_MapRGB(screen->format, r, g, b);
+        outline = RGB(r, g, b);
     }
 
+    STATS_BEGIN(StatDrawPiece);
     for (int j = 0; j < p->y; ++j) {
         for (int i = 0; i < p->x; ++i) {
             if (p->bits & mask) {
@@ -442,10 +1009,12 @@ void DrawPiece(struct Board* board, struct Piece* p, int x, int y)
             mask <<= 1;
         }
     }
+    STATS_END(StatDrawPiece);
 }
 
 void Board_Draw(struct Board* b)
 {
+    STATS_BEGIN(StatBoardDraw);
     for (int y = 0; y < b->ny; ++y) {
         for (int x = 0; x < b->nx; ++x) {
             if (!b->player[y * b->nx + x])
@@ -455,6 +1024,7 @@ void Board_Draw(struct Board* b)
                 DrawPiece(b, p, x - p->anchorX, y - p->anchorY);
         }
     }
+    STATS_END(StatBoardDraw);
 }
 
 struct Piece* GetNextPlayablePiece(struct Player* player, struct Piece* p)
@@ -462,7 +1032,7 @@ struct Piece* GetNextPlayablePiece(struct Player* player, struct Piece* p)
     int num = p ? p->num : -1;
 
     while (1) {
-        num = (num + 1) % (numDefaultPieces - 1);
+        num = (num + 1) % numPieces;
         p = player->pieces[num];
         if (p->inPlay == StatusUnplayed)
             break;
@@ -472,6 +1042,7 @@ struct Piece* GetNextPlayablePiece(struct Player* player, struct Piece* p)
     p->inPlay = StatusPlaying;
 
     struct Piece* piece = (struct Piece*)malloc(sizeof(struct Piece));
+    STATS_COUNT(StatAllocs, 1);
     *piece = *p;
 
     return piece;
@@ -499,55 +1070,286 @@ bool PlacePiece(struct Board* board, struct Piece* dragging, int x, int y)
     return false;
 }
 
-void RedrawScreen(struct Board* b, struct Board** bg)
+static void Piece_ResetShape(struct Piece* p)
+{
+    const struct Piece* orig = &pieceSet[p->num];
+
+    p->x = orig->x;
+    p->y = orig->y;
+    p->bits = orig->bits;
+    p->body = orig->body;
+    p->touching = orig->touching;
+    p->diag = orig->diag;
+}
+
+// Packs the player's pieces into the tray, each starting from its original
+// orientation so the layout is the same every time.  Returns false if the
+// tray ran out of rows before every piece was placed.
+bool Tray_Layout(struct Board* tray, struct Player* player)
 {
-    SDL_Rect r = {.x = 0, .y = 0, .w = SCREENX, .h = SCREENY };
+    int x = 0;
+    int y = 0;
+
+    Board_Clear(tray);
+    for (int i = 0; i < numPieces; ++i) {
+        struct Piece* p = player->pieces[i];
+        bool fits = false;
+
+        Piece_ResetShape(p);
+        while (!fits) {
+            if (y >= tray->ny)
+                return false;
+            for (int rotates = 4;; --rotates) {
+                fits = CheckPieceFits(tray, x, y, p, player, player, 0);
+                if (fits || rotates == 0)
+                    break;
+                if (rotates & 1)
+                    Piece_Rotate90(p);
+                else
+                    Piece_Flip(p);
+            }
+            if (fits)
+                Board_PlayPiece(tray, p, x, y);
+            if (++x >= tray->nx) {
+                x = 0;
+                y++;
+            }
+        }
+    }
+    return true;
+}
+
+// Largest tray square size, down to MINTRAYSQUARE, at which every piece of
+// the set fits in a tray; 0 if the set does not fit at all.
+int Tray_SquareSize()
+{
+    struct Player* player = Player_New(0, 0);
+    int size;
+
+    for (size = SQX / 2; size >= MINTRAYSQUARE; --size) {
+        struct Board* tray = Board_New(TRAYW / size, TRAYH / size, size, size);
+        bool fits = Tray_Layout(tray, player);
+        Board_Delete(tray);
+        if (fits)
+            break;
+    }
+    Player_Delete(player);
+    return size < MINTRAYSQUARE ? 0 : size;
+}
 
-    SDL_FillRect(screen, &r, 0);
+void RedrawScreen(struct Board* b, struct Board** bg)
+{
+    STATS_BEGIN(StatRedrawScreen);
+    Render_Clear();
     Board_Draw(b);
 
     int n;
     for (n = 0; n < numPlayers; ++n) {
         if (bg[n]->dirty) {
+            STATS_BEGIN(StatTrayPack);
             bg[n]->dirty = false;
-            Board_Clear(bg[n]);
-
-            int x = 0;
-            int y = 0;
-            int i = 0;
-            struct Player* player = players[n];
-            while (y < b->ny) {
-                struct Piece* p = player->pieces[i];
-                if (!p) {
-                    ++i;
-                    continue;
-                }
-                if (!p->x)
-                    break;
-                for (int rotates = 4;;) {
-                    if (CheckPieceFits(bg[n], x, y, p, player, player, 0))
-                        break;
-                    if (rotates == 0) {
-                        goto nextSquare;
-                    } else {
-                        if (rotates & 1)
-                            Piece_Rotate90(p);
-                        else
-                            Piece_Flip(p);
-                        rotates--;
-                    }
-                }
-                Board_PlayPiece(bg[n], p, x, y);
-                i++;
-nextSquare:
-                if (++x >= bg[n]->nx) {
-                    x = 0;
-                    y++;
-                }
-            }
+            Tray_Layout(bg[n], players[n]);
+            STATS_END(StatTrayPack);
         }
         Board_Draw(bg[n]);
     }
+    STATS_END(StatRedrawScreen);
+}
+
+// Input comes from SDL, optionally recorded to a file, or is replayed from a
+// recording.  A recording is one event per line: "ms type a b c", with ms
+// since startup and a, b, c depending on the event type.  Replay runs as
+// fast as possible on a virtual clock that advances 10ms per idle poll, as
+// MainLoop does live, unless realtime is set.
+struct Input {
+    FILE* record;
+    FILE* replay;
+    bool realtime;
+    uint32_t start;
+    uint32_t now; // Virtual SDL_GetTicks when replaying as fast as possible
+    bool pending;
+    uint32_t nextTime;
+    SDL_Event next;
+    double* frameMs;
+    int numFrames;
+    int maxFrames;
+};
+
+static struct Input input;
+
+bool Input_Init(const char* recordFile, const char* replayFile, bool realtime)
+{
+    if (recordFile && !(input.record = fopen(recordFile, "w"))) {
+        fprintf(stderr, "Unable to open %s\n", recordFile);
+        return false;
+    }
+    if (replayFile && !(input.replay = fopen(replayFile, "r"))) {
+        fprintf(stderr, "Unable to open %s\n", replayFile);
+        return false;
+    }
+    input.realtime = realtime;
+    input.start = input.now = SDL_GetTicks();
+    return true;
+}
+
+uint32_t Input_Ticks()
+{
+    if (!input.replay || input.realtime)
+        return SDL_GetTicks();
+    return input.now;
+}
+
+static void Input_Record(const SDL_Event* e)
+{
+    int a, b, c;
+
+    switch (e->type) {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        a = e->key.keysym.sym;
+        b = e->key.keysym.mod;
+        c = e->key.repeat;
+        break;
+    case SDL_MOUSEMOTION:
+        a = e->motion.x;
+        b = e->motion.y;
+        c = e->motion.state;
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        a = e->button.button;
+        b = e->button.x;
+        c = e->button.y;
+        break;
+    case SDL_WINDOWEVENT:
+        a = e->window.event;
+        b = e->window.data1;
+        c = e->window.data2;
+        break;
+    case SDL_QUIT:
+        a = b = c = 0;
+        break;
+    default:
+        return;
+    }
+    fprintf(input.record, "%u %u %d %d %d\n", SDL_GetTicks() - input.start, e->type, a, b, c);
+}
+
+static void Input_ReadNext()
+{
+    unsigned type;
+    int a, b, c;
+    SDL_Event* e = &input.next;
+
+    if (fscanf(input.replay, "%u %u %d %d %d", &input.nextTime, &type, &a, &b, &c) != 5) {
+        // End of the recording
+        memset(e, 0, sizeof(*e));
+        e->type = SDL_QUIT;
+        return;
+    }
+    input.nextTime += input.start;
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    switch (type) {
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        e->key.keysym.sym = a;
+        e->key.keysym.mod = b;
+        e->key.repeat = c;
+        break;
+    case SDL_MOUSEMOTION:
+        e->motion.x = a;
+        e->motion.y = b;
+        e->motion.state = c;
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        e->button.button = a;
+        e->button.x = b;
+        e->button.y = c;
+        break;
+    case SDL_WINDOWEVENT:
+        e->window.event = a;
+        e->window.data1 = b;
+        e->window.data2 = c;
+        break;
+    }
+}
+
+// Like SDL_PollEvent
+int Input_Poll(SDL_Event* event)
+{
+    if (!input.replay) {
+        int r = SDL_PollEvent(event);
+        if (r && input.record)
+            Input_Record(event);
+        return r;
+    }
+
+    if (!input.pending) {
+        Input_ReadNext();
+        input.pending = true;
+    }
+    if (input.nextTime > Input_Ticks() && input.next.type != SDL_QUIT)
+        return 0;
+    input.pending = false;
+    *event = input.next;
+    return 1;
+}
+
+// Called when there was no event to handle
+void Input_Idle()
+{
+    if (input.replay && !input.realtime)
+        input.now += 10;
+    else
+        SDL_Delay(10);
+}
+
+void Input_FrameDone(Uint64 frameStart)
+{
+    if (!input.replay)
+        return;
+    if (input.numFrames == input.maxFrames) {
+        input.maxFrames = input.maxFrames ? input.maxFrames * 2 : 1024;
+        input.frameMs = (double*)realloc(input.frameMs, sizeof(double) * input.maxFrames);
+    }
+    input.frameMs[input.numFrames++]
+        = (SDL_GetPerformanceCounter() - frameStart) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+static int CompareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double Percentile(const double* sorted, int n, int pct)
+{
+    int i = (n * pct + 99) / 100 - 1;
+    return sorted[i < 0 ? 0 : i];
+}
+
+void Input_Deinit()
+{
+    if (input.record)
+        fclose(input.record);
+    if (input.replay) {
+        int n = input.numFrames;
+        double total = 0;
+
+        fclose(input.replay);
+        qsort(input.frameMs, n, sizeof(double), CompareDoubles);
+        for (int i = 0; i < n; ++i)
+            total += input.frameMs[i];
+        printf("frames %d, render ms total %.3f", n, total);
+        if (n)
+            printf(", p50 %.3f, p90 %.3f, p99 %.3f, max %.3f", Percentile(input.frameMs, n, 50),
+                Percentile(input.frameMs, n, 90), Percentile(input.frameMs, n, 99), input.frameMs[n - 1]);
+        printf("\n");
+        free(input.frameMs);
+    }
 }
 
 int MainLoop()
@@ -563,7 +1365,6 @@ int MainLoop()
     struct Player* player = players[curPlayer];
     int left = (SCREENX - (BOARDX * SQX)) / 2;
     int top = (SCREENY - (BOARDY * SQY)) / 2;
-    int bottom = SCREENY - top - 1;
     int right = SCREENX - left - 1;
     struct Board* board = Board_New(BOARDX, BOARDY, SQX, SQY);
     struct Piece* dragging = 0;
@@ -571,39 +1372,40 @@ int MainLoop()
     board->x = left;
     board->y = top;
 
-    bg[0] = Board_New(left / (SQX / 2), bottom / (SQY / 2), SQX / 2, SQY / 2);
+    bg[0] = Board_New(TRAYW / traySquare, TRAYH / traySquare, traySquare, traySquare);
     bg[0]->x = 0;
     bg[0]->y = 0;
     bg[0]->color = 0;
-    bg[1] = Board_New(left / (SQX / 2), bottom / (SQY / 2), SQX / 2, SQY / 2);
+    bg[1] = Board_New(TRAYW / traySquare, TRAYH / traySquare, traySquare, traySquare);
     bg[1]->x = right + 1;
     bg[1]->y = 0;
     bg[1]->color = 0;
-    bg[2] = Board_New(left / (SQX / 2), bottom / (SQY / 2), SQX / 2, SQY / 2);
+    bg[2] = Board_New(TRAYW / traySquare, TRAYH / traySquare, traySquare, traySquare);
     bg[2]->x = right + 1;
-    bg[2]->y = SCREENY / 2;
+    bg[2]->y = TRAYH;
     bg[2]->color = 0;
-    bg[3] = Board_New(left / (SQX / 2), bottom / (SQY / 2), SQX / 2, SQY / 2);
+    bg[3] = Board_New(TRAYW / traySquare, TRAYH / traySquare, traySquare, traySquare);
     bg[3]->x = 0;
-    bg[3]->y = SCREENY / 2;
+    bg[3]->y = TRAYH;
     bg[3]->color = 0;
 
     do {
         if (dirty || dirtyPiece) {
+            Uint64 frameStart = SDL_GetPerformanceCounter();
             RedrawScreen(board, bg);
-        }
-        if (dragging && dirtyPiece) {
-            bool playable = CheckPiecePlayable(board, px, py, dragging);
-            dragging->inPlay = playable ? StatusPlayable : StatusNotPlayable;
-            DrawPiece(board, dragging, px, py);
-        }
-        if (dirty || dirtyPiece) {
+            if (dragging) {
+                bool playable = CheckPiecePlayable(board, px, py, dragging);
+                dragging->inPlay = playable ? StatusPlayable : StatusNotPlayable;
+                DrawPiece(board, dragging, px, py);
+            }
             dirty = dirtyPiece = false;
-            SDL_UpdateRect(screen, 0, 0, 0, 0);
+            Render_Present();
+            STATS_COUNT(StatFrames, 1);
+            Input_FrameDone(frameStart);
         }
 
-        if (SDL_PollEvent(&event) == 0) {
-            SDL_Delay(10);
+        if (Input_Poll(&event) == 0) {
+            Input_Idle();
         } else {
             switch (event.type) {
             case SDL_KEYUP: {
@@ -631,6 +1433,9 @@ int MainLoop()
             }
 
             case SDL_KEYDOWN: {
+                // SDL 1.2 had no key repeat; held arrows move via vx/vy
+                if (event.key.repeat)
+                    break;
                 switch (event.key.keysym.sym) {
                 case SDLK_TAB: {
                     struct Piece* nextPiece = GetNextPlayablePiece(player, dragging);
@@ -731,6 +1536,11 @@ int MainLoop()
                 }
                 break;
 
+            case SDL_WINDOWEVENT:
+                // Rescaled by the renderer; just repaint
+                dirty = true;
+                break;
+
             case SDL_QUIT:
                 goto done;
             }
@@ -738,7 +1548,7 @@ int MainLoop()
 
         if (vx || vy) {
             static uint32_t prev = 0;
-            uint32_t now = SDL_GetTicks();
+            uint32_t now = Input_Ticks();
             if (now < prev || now - prev > 70) {
                 prev = now;
                 px += vx;
@@ -763,42 +1573,96 @@ done:
     return 0;
 }
 
+void Usage()
+{
+    fprintf(stderr, "Simple block game <https://github.com/ccoffing/blokus>\n");
+    fprintf(stderr, "Copyright (c) 2017 Chuck Coffing <clc@alum.mit.edu>\n");
+    fprintf(stderr, "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>\n\n");
+    fprintf(stderr, "Usage: blokus [options]\n");
+    fprintf(stderr, "    --pieces FILE       Load the piece set from FILE; one piece per line,\n");
+    fprintf(stderr, "                        rows separated by '/', e.g. \"XX/X.\"\n");
+    fprintf(stderr, "    --polyominoes N     Play with every polyomino of 1-N squares (default 5)\n");
+    fprintf(stderr, "    --stats             Print hot-path counters and timings at exit\n");
+    fprintf(stderr, "    --trace FILE        Write a Chrome/Perfetto trace to FILE at exit\n");
+    fprintf(stderr, "    --record FILE       Record input events to FILE\n");
+    fprintf(stderr, "    --replay FILE       Replay recorded input (headless unless SDL_VIDEODRIVER\n");
+    fprintf(stderr, "                        is set) and print frame render times; use the same\n");
+    fprintf(stderr, "                        piece options as when recording\n");
+    fprintf(stderr, "    --realtime          Replay at the recorded pace\n\n");
+    fprintf(stderr, "Gameplay:\n");
+    fprintf(stderr, "    1-4 players.  Players take turns, starting by placing a piece anchored in\n");
+    fprintf(stderr, "    that player's corner.  A player's subsequent pieces must touch corners with\n");
+    fprintf(stderr, "    one of the player's already-played pieces, but cannot touch any of that\n");
+    fprintf(stderr, "    player's pieces face-to-face.\n");
+    fprintf(stderr, "Keys:\n");
+    fprintf(stderr, "    Tab          Next piece\n");
+    fprintf(stderr, "    Arrow keys   Drag piece\n");
+    fprintf(stderr, "    Space        Rotate piece\n");
+    fprintf(stderr, "    Shift-Space  Flip piece\n");
+    fprintf(stderr, "    Enter        Place piece\n");
+    exit(1);
+}
+
 int main(int argc, char* argv[])
 {
-    if (argc > 1) {
-        fprintf(stderr, "Simple block game <https://github.com/ccoffing/blokus>\n");
-        fprintf(stderr, "Copyright (c) 2017 Chuck Coffing <clc@alum.mit.edu>\n");
-        fprintf(stderr, "License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>\n\n");
-        fprintf(stderr, "Gameplay:\n");
-        fprintf(stderr, "    1-4 players.  Players take turns, starting by placing a piece anchored in\n");
-        fprintf(stderr, "    that player's corner.  A player's subsequent pieces must touch corners with\n");
-        fprintf(stderr, "    one of the player's already-played pieces, but cannot touch any of that\n");
-        fprintf(stderr, "    player's pieces face-to-face.\n");
-        fprintf(stderr, "Keys:\n");
-        fprintf(stderr, "    Tab          Next piece\n");
-        fprintf(stderr, "    Arrow keys   Drag piece\n");
-        fprintf(stderr, "    Space        Rotate piece\n");
-        fprintf(stderr, "    Shift-Space  Flip piece\n");
-        fprintf(stderr, "    Enter        Place piece\n");
-        exit(1);
+    const char* piecesFile = NULL;
+    int polyominoes = 5;
+    bool printStats = false;
+    const char* traceFile = NULL;
+    const char* recordFile = NULL;
+    const char* replayFile = NULL;
+    bool realtime = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--pieces") && i + 1 < argc) {
+            piecesFile = argv[++i];
+        } else if (!strcmp(argv[i], "--polyominoes") && i + 1 < argc) {
+            polyominoes = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--stats")) {
+            printStats = true;
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replayFile = argv[++i];
+        } else if (!strcmp(argv[i], "--realtime")) {
+            realtime = true;
+        } else {
+            Usage();
+        }
+    }
+    Stats_Start(traceFile != NULL);
+    if (!(piecesFile ? LoadPieces(piecesFile) : GeneratePieces(polyominoes)))
+        return -1;
+    InitPieces();
+    traySquare = Tray_SquareSize();
+    if (!traySquare) {
+        fprintf(stderr, "Too many pieces to fit in the trays\n");
+        return -1;
     }
 
+    if (replayFile)
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 0); // Headless unless overridden
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         fprintf(stderr, "\nUnable to initialize SDL:  %s\n", SDL_GetError());
         return -1;
     }
     atexit(SDL_Quit);
 
-    screen = SDL_SetVideoMode(SCREENX, SCREENY, 0, 0);
-    if (screen == NULL) {
+    if (!Render_Init()) {
+        fprintf(stderr, "\nUnable to create window:  %s\n", SDL_GetError());
         return -1;
     }
-    SDL_WM_SetCaption("Blokus", "none");
+    if (!Input_Init(recordFile, replayFile, realtime))
+        return -1;
 
-    InitPieces();
     InitPlayers();
     MainLoop();
     DeinitPlayers();
+    Render_Deinit();
+    Input_Deinit();
+    Stats_Report(printStats, traceFile);
 
     return 0;
 }